@@ -8,14 +8,38 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <map>
+#include <algorithm>
+#include <cmath>
 #include <functional>
 #include <fstream>
 #include <set>
+#include <list>
 #include <stack>
 #include <optional>
 #include <unistd.h>
 #include <pwd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 #include <sstream>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <new>
 #include <assert.h>
 
 constexpr int MAX_BUFFER = 1024;
@@ -52,6 +76,46 @@ std::string get_user_name() {
     }
 }
 
+long long get_file_size(const std::string& path) {
+    struct stat status;
+    if (stat(path.c_str(), &status) == 0 && S_ISREG(status.st_mode)) {
+        return status.st_size;
+    } else {
+        return -1;
+    }
+}
+
+/*
+* 创建目录，和 mkdir -p 一样会创建不存在的上级目录
+*/
+bool make_directories(const std::string& path) {
+	for (size_t index = 1; index <= path.length(); index++) {
+		if (index == path.length() || path[index] == '/') {
+			auto prefix = path.substr(0, index);
+			if (mkdir(prefix.c_str(), 0755) == -1 && errno != EEXIST) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/*
+* 64 位 FNV-1a 哈希
+*/
+uint64_t get_fnv1a_hash(const char* data, size_t length) {
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t index = 0; index < length; index++) {
+		hash ^= (unsigned char) data[index];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+uint64_t get_fnv1a_hash(const std::string& data) {
+	return get_fnv1a_hash(data.data(), data.length());
+}
+
 /*
 * 和 Shell 有关的异常
 */
@@ -66,6 +130,393 @@ protected:
 	std::string message;
 };
 
+/*
+* 一个追踪事件，即一段有名字的时间区间，导出为 Chrome trace 中 "ph":"X" 的事件
+*/
+struct TraceEvent {
+	char name[64];
+	const char* category;
+	long long begin_us;
+	long long duration_us;
+};
+
+/*
+* 每个线程独有的追踪事件环形缓冲区
+* 只有所属线程会写入，因此写入不需要加锁；写满后覆盖最旧的事件
+*/
+class TraceRing {
+public:
+	static constexpr size_t CAPACITY = 4096;
+
+	explicit TraceRing(long long thread_id) : thread_id(thread_id) {}
+
+	void push(const TraceEvent& event) {
+		auto index = head.load(std::memory_order_relaxed);
+		events[index % CAPACITY] = event;
+		head.store(index + 1, std::memory_order_release);
+	}
+
+	std::vector<TraceEvent> get_events() {
+		auto end = head.load(std::memory_order_acquire);
+		auto begin = end > CAPACITY ? end - CAPACITY : 0;
+
+		std::vector<TraceEvent> result;
+		result.reserve(end - begin);
+		for (auto index = begin; index < end; index++) {
+			result.emplace_back(events[index % CAPACITY]);
+		}
+		return result;
+	}
+
+	void clear() {
+		head.store(0, std::memory_order_release);
+	}
+
+	long long get_thread_id() {
+		return thread_id;
+	}
+protected:
+	const long long thread_id;
+	std::atomic<size_t> head{0};
+	TraceEvent events[CAPACITY];
+};
+
+/*
+* 执行阶段追踪器，可以把记录的事件导出为 Chrome trace event JSON，用 Perfetto 查看
+* 默认关闭，关闭时记录事件只有一次原子读的开销
+*/
+class Tracer {
+public:
+	static Tracer& get_instance() {
+		static Tracer instance;
+		return instance;
+	}
+
+	bool is_enabled() {
+		return enabled.load(std::memory_order_relaxed);
+	}
+
+	void set_enabled(bool enabled) {
+		this->enabled.store(enabled, std::memory_order_relaxed);
+	}
+
+	void set_export_path(std::string export_path) {
+		this->export_path = export_path;
+	}
+
+	std::string get_export_path() {
+		return export_path;
+	}
+
+	long long now_us() {
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - epoch).count();
+	}
+
+	void record(const char* category, const char* name, long long begin_us, long long duration_us) {
+		TraceEvent event;
+		strncpy(event.name, name, sizeof(event.name) - 1);
+		event.name[sizeof(event.name) - 1] = '\0';
+		event.category = category;
+		event.begin_us = begin_us;
+		event.duration_us = duration_us;
+		get_local_ring().push(event);
+	}
+
+	void clear() {
+		std::lock_guard<std::mutex> lock(rings_mutex);
+		for (auto& ring : rings) {
+			ring->clear();
+		}
+	}
+
+	bool export_chrome_trace(std::string path) {
+		std::ofstream file(path, std::ios::out | std::ios::trunc);
+		if (!file.is_open()) {
+			return false;
+		}
+
+		std::lock_guard<std::mutex> lock(rings_mutex);
+		auto pid = getpid();
+		bool first = true;
+
+		file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+		for (auto& ring : rings) {
+			for (auto& event : ring->get_events()) {
+				file << (first ? "\n" : ",\n")
+					<< "{\"name\":\"" << escape(event.name) << "\",\"cat\":\"" << event.category
+					<< "\",\"ph\":\"X\",\"ts\":" << event.begin_us << ",\"dur\":" << event.duration_us
+					<< ",\"pid\":" << pid << ",\"tid\":" << ring->get_thread_id() << "}";
+				first = false;
+			}
+		}
+		file << "\n]}\n";
+		return file.good();
+	}
+protected:
+	Tracer() = default;
+
+	TraceRing& get_local_ring() {
+		thread_local TraceRing* ring = nullptr;
+		if (!ring) {
+			// 每个线程只在第一次记录时注册一次，之后的写入不再加锁
+			std::lock_guard<std::mutex> lock(rings_mutex);
+			rings.emplace_back(new TraceRing((long long) rings.size() + 1));
+			ring = rings.back().get();
+		}
+		return *ring;
+	}
+
+	static std::string escape(const char* text) {
+		std::string result;
+		for (; *text; text++) {
+			auto ch = *text;
+			if (ch == '"' || ch == '\\') {
+				result.push_back('\\');
+				result.push_back(ch);
+			} else if ((unsigned char) ch < 0x20) {
+				result.push_back(' ');
+			} else {
+				result.push_back(ch);
+			}
+		}
+		return result;
+	}
+
+	std::atomic<bool> enabled{false};
+	std::string export_path;
+	const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+	std::mutex rings_mutex;
+	std::vector<std::unique_ptr<TraceRing>> rings;
+};
+
+/*
+* 追踪一个作用域的执行时间，析构时记录事件
+*/
+class TraceSpan {
+public:
+	TraceSpan(const char* category, const char* name) : category(category) {
+		if (Tracer::get_instance().is_enabled()) {
+			this->name = name;
+			begin_us = Tracer::get_instance().now_us();
+		}
+	}
+
+	// 名字需要拼接时传入生成名字的函数，只有开启追踪时才会调用，关闭时不构造字符串
+	template <typename NameSupplier>
+	TraceSpan(const char* category, NameSupplier get_name) : category(category) {
+		if (Tracer::get_instance().is_enabled()) {
+			name = get_name();
+			begin_us = Tracer::get_instance().now_us();
+		}
+	}
+
+	~TraceSpan() {
+		if (begin_us >= 0) {
+			auto& tracer = Tracer::get_instance();
+			tracer.record(category, name.c_str(), begin_us, tracer.now_us() - begin_us);
+		}
+	}
+
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+protected:
+	const char* category;
+	std::string name;
+	long long begin_us = -1;
+};
+
+/*
+* 内存分配计数器，计数对所有线程可见
+* live_bytes 是由它分配、尚未释放的字节数，peak_bytes 是 live_bytes 的最大值
+*/
+struct MemoryCounter {
+	std::atomic<size_t> allocations{0};
+	std::atomic<size_t> allocated_bytes{0};
+	std::atomic<size_t> live_bytes{0};
+	std::atomic<size_t> peak_bytes{0};
+
+	void on_allocate(size_t size) {
+		allocations.fetch_add(1, std::memory_order_relaxed);
+		allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+		auto live = live_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+		auto peak = peak_bytes.load(std::memory_order_relaxed);
+		while (live > peak && !peak_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+	}
+
+	void on_free(size_t size) {
+		live_bytes.fetch_sub(size, std::memory_order_relaxed);
+	}
+
+	// 重置累计值，live_bytes 表示当前状态，不重置
+	void reset() {
+		allocations.store(0, std::memory_order_relaxed);
+		allocated_bytes.store(0, std::memory_order_relaxed);
+		peak_bytes.store(live_bytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+};
+
+/*
+* 按指令头统计内存分配，需要用 -DCHUANWISE_SHELL_MEMSTATS 编译以替换全局的 operator new / delete
+* 每个线程的分配记在该线程正在执行的指令上，释放记在分配它的指令上
+*/
+class MemoryAccounting {
+public:
+#ifdef CHUANWISE_SHELL_MEMSTATS
+	static constexpr bool ENABLED = true;
+#else
+	static constexpr bool ENABLED = false;
+#endif
+
+	// 计数器在程序退出时仍可能被 operator delete 使用，因此永不析构
+	static MemoryAccounting& get_instance() {
+		static MemoryAccounting* instance = new MemoryAccounting();
+		return *instance;
+	}
+
+	static MemoryCounter& get_total_counter() {
+		static MemoryCounter counter;
+		return counter;
+	}
+
+	static MemoryCounter*& get_current_counter() {
+		thread_local MemoryCounter* counter = nullptr;
+		return counter;
+	}
+
+	MemoryCounter* get_counter(const std::string& head) {
+		std::lock_guard<std::mutex> lock(counters_mutex);
+		auto& counter = counters[head];
+		if (!counter) {
+			counter = new MemoryCounter();
+		}
+		return counter;
+	}
+
+	std::vector<std::pair<std::string, MemoryCounter*>> get_counters() {
+		std::lock_guard<std::mutex> lock(counters_mutex);
+		return std::vector<std::pair<std::string, MemoryCounter*>>(counters.begin(), counters.end());
+	}
+
+	void reset() {
+		std::lock_guard<std::mutex> lock(counters_mutex);
+		for (auto& counter : counters) {
+			counter.second->reset();
+		}
+		get_total_counter().reset();
+	}
+protected:
+	MemoryAccounting() = default;
+
+	std::mutex counters_mutex;
+	std::map<std::string, MemoryCounter*> counters;
+};
+
+/*
+* 在作用域内把当前线程的分配记在指令头 head 上
+*/
+class MemoryScope {
+public:
+	explicit MemoryScope(const std::string& head) {
+		if (MemoryAccounting::ENABLED) {
+			auto& current = MemoryAccounting::get_current_counter();
+			elder_counter = current;
+			current = MemoryAccounting::get_instance().get_counter(head);
+		}
+	}
+
+	~MemoryScope() {
+		if (MemoryAccounting::ENABLED) {
+			MemoryAccounting::get_current_counter() = elder_counter;
+		}
+	}
+
+	MemoryScope(const MemoryScope&) = delete;
+	MemoryScope& operator=(const MemoryScope&) = delete;
+protected:
+	MemoryCounter* elder_counter = nullptr;
+};
+
+#ifdef CHUANWISE_SHELL_MEMSTATS
+/*
+* 每次分配前面加一个头，记录大小和分配它的计数器，对齐到 max_align_t
+*/
+struct alignas(alignof(std::max_align_t)) AllocationHeader {
+	size_t size;
+	MemoryCounter* counter;
+};
+
+void* allocate_with_header(size_t size) {
+	auto header = (AllocationHeader*) malloc(sizeof(AllocationHeader) + size);
+	if (!header) {
+		return nullptr;
+	}
+	header->size = size;
+	header->counter = MemoryAccounting::get_current_counter();
+	MemoryAccounting::get_total_counter().on_allocate(size);
+	if (header->counter) {
+		header->counter->on_allocate(size);
+	}
+	return header + 1;
+}
+
+void free_with_header(void* pointer) {
+	if (!pointer) {
+		return;
+	}
+	auto header = (AllocationHeader*) pointer - 1;
+	MemoryAccounting::get_total_counter().on_free(header->size);
+	if (header->counter) {
+		header->counter->on_free(header->size);
+	}
+	free(header);
+}
+
+void* operator new(size_t size) {
+	auto pointer = allocate_with_header(size);
+	if (!pointer) {
+		throw std::bad_alloc();
+	}
+	return pointer;
+}
+
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+	return allocate_with_header(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+	return allocate_with_header(size);
+}
+
+void operator delete(void* pointer) noexcept {
+	free_with_header(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+	free_with_header(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+	free_with_header(pointer);
+}
+
+void operator delete[](void* pointer, size_t) noexcept {
+	free_with_header(pointer);
+}
+
+void operator delete(void* pointer, const std::nothrow_t&) noexcept {
+	free_with_header(pointer);
+}
+
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept {
+	free_with_header(pointer);
+}
+#endif
+
 /*
 * 表示 Shell 的一次有效输入
 */
@@ -174,8 +625,8 @@ protected:
 	std::string err_redirection;
 	std::string out_redirection;
 
-	std::ios::openmode out_mode;
-	std::ios::openmode err_out_mode;
+	std::ios::openmode out_mode = std::ios::out | std::ios::trunc;
+	std::ios::openmode err_out_mode = std::ios::out | std::ios::trunc;
 };
 
 /*
@@ -193,6 +644,7 @@ public:
 
 	void add_keyword(std::string keyword) {
 		keywords.insert(keyword);
+		max_keyword_length = std::max(max_keyword_length, keyword.length());
 	}
 
 	std::set<std::string> get_keywords() {
@@ -200,112 +652,785 @@ public:
 	}
 
 	std::vector<std::string> split(std::string input) {
-		char* ptr = nullptr;
 		std::vector<std::string> result;
-
-		enum class State {
-			SPACING,
-			ARGUMENT,
-			BOARD_ARGUMENT,
+		auto on_token = [&result](std::string token) {
+			result.emplace_back(std::move(token));
 		};
 
-		State state = State::SPACING;
-		std::string buffer;
+		reset();
+		feed(input.data(), input.length(), on_token);
+		finish(on_token);
+		return result;
+	}
 
-		std::string last_keyword;
-		bool is_keyword_prefix = false;
-		bool is_keyword = false;
+	/*
+	* 流式解析：输入可以分成任意多段依次喂入，解析状态在两次调用之间保留
+	* 每解析出一个 Token 就交给 on_token，全部喂完后调用 finish
+	*/
+	void feed(const char* data, size_t length, const std::function<void(std::string)>& on_token) {
+		for (size_t index = 0; index < length; index++) {
+			on_char(data[index], on_token);
+		}
+	}
 
-		for (int index = 0; index < input.length(); index++) {
-			auto& ch = input[index];
+	void finish(const std::function<void(std::string)>& on_token) {
+		// 最后一个参数可能因为循环到结尾而没有纳入
+		flush_token(on_token);
+		reset();
+	}
 
-			switch (state) {
-			case State::SPACING:
-				// 空字符不改变状态
-				if (space.find(ch) != std::string::npos) {
-					continue;
-				}
-				// 特殊范围标记的参数，例如 "argument with spaces"
-				if (board.find(ch) != std::string::npos) {
-					state = State::BOARD_ARGUMENT;
-					continue;
-				}
-				// 其他则是普通参数
-				buffer.push_back(ch);
-				state = State::ARGUMENT;
-				break;
-			case State::ARGUMENT:
-				// 空字符或是关键字则保存当前输入，并迁移到空字符状态
-				if (space.find(ch) != std::string::npos) {
-					state = State::SPACING;
-					result.emplace_back(buffer);
-					buffer.clear();
-					continue;
-				}
-				// 如果是关键词，可能会有相同前缀的关键词例如 >> 和 >
+	void reset() {
+		state = State::SPACING;
+		buffer.clear();
+		last_keyword.clear();
+		is_keyword_prefix = false;
+		is_keyword = false;
+	}
+protected:
+	enum class State {
+		SPACING,
+		ARGUMENT,
+		BOARD_ARGUMENT,
+	};
+
+	// 交出缓冲区中的 Token，关键字匹配的进度只属于这个 Token，一起清空
+	void end_token(const std::function<void(std::string)>& on_token) {
+		on_token(buffer);
+		buffer.clear();
+		last_keyword.clear();
+		is_keyword_prefix = false;
+		is_keyword = false;
+	}
+
+	// 参数结束时，关键字后面可能还跟着没来得及回滚的字符，例如 >a-file.txt
+	// 此时先交出关键字，再重新解析剩下的部分
+	void flush_token(const std::function<void(std::string)>& on_token) {
+		while (!last_keyword.empty() && buffer.length() > last_keyword.length() && keywords.count(buffer) == 0) {
+			auto remain = buffer.substr(last_keyword.length());
+			buffer = last_keyword;
+			end_token(on_token);
+
+			for (auto remain_ch : remain) {
+				on_char(remain_ch, on_token);
+			}
+		}
+		if (!buffer.empty()) {
+			end_token(on_token);
+		}
+	}
+
+	void on_char(char ch, const std::function<void(std::string)>& on_token) {
+		switch (state) {
+		case State::SPACING:
+			// 空字符不改变状态
+			if (space.find(ch) != std::string::npos) {
+				return;
+			}
+			// 特殊范围标记的参数，例如 "argument with spaces"
+			if (board.find(ch) != std::string::npos) {
+				state = State::BOARD_ARGUMENT;
+				return;
+			}
+			// 其他则是普通参数
+			buffer.push_back(ch);
+			state = State::ARGUMENT;
+			break;
+		case State::ARGUMENT:
+			// 空字符或是关键字则保存当前输入，并迁移到空字符状态
+			if (space.find(ch) != std::string::npos) {
+				flush_token(on_token);
+				state = State::SPACING;
+				return;
+			}
+			// 如果是关键词，可能会有相同前缀的关键词例如 >> 和 >
+			// 缓冲区比最长的关键字还长时，以关键字开头的情况已经在更短的时候检查过了
+			if (buffer.length() <= max_keyword_length) {
 				for (auto& keyword : keywords) {
-					if (buffer.find(keyword) == 0) {
+					if (buffer.compare(0, keyword.length(), keyword) == 0) {
 						is_keyword_prefix = true;
 						// 之前的是 keyword 或当前的是
 						is_keyword = is_keyword || keyword.length() == buffer.length();
 					}
 				}
+			}
 
-				// 如果找到有前缀和当前缓存区相同的，可能就是上述的特殊情况
-				if (is_keyword_prefix) {
-					// 如果也找到了关键词，那就先继续往下寻找，因为还可能有更长的关键词
-					if (is_keyword) {
-						last_keyword = buffer;
-						is_keyword = false;
-					} else if (!last_keyword.empty()) {
-						// 否则就是找到了，回滚到最后一次，也就是最长的 buffer
-						// 多 -1 是为了消除循环结束 + 1 的影响
-						index -= buffer.length() - last_keyword.length() + 1;
-						buffer = last_keyword;
-						last_keyword.clear();
-
-						result.emplace_back(buffer);
-						buffer.clear();
-						is_keyword = false;
-						is_keyword_prefix = false;
-						continue;
+			// 如果找到有前缀和当前缓存区相同的，可能就是上述的特殊情况
+			if (is_keyword_prefix) {
+				// 如果也找到了关键词，那就先继续往下寻找，因为还可能有更长的关键词
+				if (is_keyword) {
+					last_keyword = buffer;
+					is_keyword = false;
+				} else if (!last_keyword.empty()) {
+					// 否则就是找到了，回滚到最后一次，也就是最长的 buffer
+					// last_keyword 是缓冲区的前缀，因此回滚就是把关键词之后的字符和当前字符重新解析一遍
+					auto remain = buffer.substr(last_keyword.length()) + ch;
+					buffer = last_keyword;
+					end_token(on_token);
+
+					for (auto remain_ch : remain) {
+						on_char(remain_ch, on_token);
 					}
+					return;
 				}
+			}
 
-				buffer.push_back(ch);
-				break;
-			case State::BOARD_ARGUMENT:
-				// 特殊范围标记符号时退出
-				if (board.find(ch) != std::string::npos) {
-					state = State::SPACING;
-					result.emplace_back(buffer);
-					buffer.clear();
-					continue;
+			buffer.push_back(ch);
+			break;
+		case State::BOARD_ARGUMENT:
+			// 特殊范围标记符号时退出
+			if (board.find(ch) != std::string::npos) {
+				state = State::SPACING;
+				end_token(on_token);
+				return;
+			}
+			buffer.push_back(ch);
+			break;
+		default:
+			throw ShellException("an internal error occurs: illegal state for argument parse FSM");
+		}
+	}
+
+	std::string space = " \n\t\r";
+
+	std::string board = "\"";
+
+	std::set<std::string> keywords;
+	size_t max_keyword_length = 0;
+
+	// 解析状态，在多次 feed 之间保留
+	State state = State::SPACING;
+	std::string buffer;
+	std::string last_keyword;
+	bool is_keyword_prefix = false;
+	bool is_keyword = false;
+};
+
+/*
+* 丢弃所有输出的 streambuf
+*/
+class NullStreambuf : public std::streambuf {
+protected:
+	int overflow(int ch) override {
+		return traits_type::not_eof(ch);
+	}
+
+	std::streamsize xsputn(const char* data, std::streamsize count) override {
+		return count;
+	}
+};
+
+/*
+* 在作用域内把标准输出和标准错误的文件描述符指向 /dev/null
+* ls 等通过 system 执行的指令直接写文件描述符，替换 streambuf 不能丢弃它们的输出
+*/
+class DiscardedOutputFds {
+public:
+	DiscardedOutputFds() {
+		fflush(stdout);
+		fflush(stderr);
+		null_fd = open("/dev/null", O_WRONLY);
+		elder_out_fd = dup(STDOUT_FILENO);
+		elder_err_fd = dup(STDERR_FILENO);
+		dup2(null_fd, STDOUT_FILENO);
+		dup2(null_fd, STDERR_FILENO);
+	}
+
+	~DiscardedOutputFds() {
+		fflush(stdout);
+		fflush(stderr);
+		dup2(elder_out_fd, STDOUT_FILENO);
+		dup2(elder_err_fd, STDERR_FILENO);
+		close(elder_out_fd);
+		close(elder_err_fd);
+		close(null_fd);
+	}
+
+	DiscardedOutputFds(const DiscardedOutputFds&) = delete;
+	DiscardedOutputFds& operator=(const DiscardedOutputFds&) = delete;
+protected:
+	int null_fd;
+	int elder_out_fd;
+	int elder_err_fd;
+};
+
+/*
+* 获得已排序序列的百分位数（最近秩法），rate 取 [0, 1]
+*/
+double get_percentile(const std::vector<double>& sorted, double rate) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	auto rank = (size_t) std::ceil(rate * sorted.size());
+	return sorted[rank == 0 ? 0 : rank - 1];
+}
+
+/*
+* 一组样本的统计量，离群值按 Tukey 法则（超出四分位距 1.5 倍）计算
+*/
+struct Statistics {
+	double min = 0;
+	double median = 0;
+	double p99 = 0;
+	double mean = 0;
+	double stddev = 0;
+	size_t outliers = 0;
+};
+
+Statistics get_statistics(std::vector<double> samples) {
+	Statistics result;
+	if (samples.empty()) {
+		return result;
+	}
+	std::sort(samples.begin(), samples.end());
+
+	result.min = samples.front();
+	result.median = get_percentile(samples, 0.5);
+	result.p99 = get_percentile(samples, 0.99);
+	for (auto sample : samples) {
+		result.mean += sample;
+	}
+	result.mean /= samples.size();
+	for (auto sample : samples) {
+		result.stddev += (sample - result.mean) * (sample - result.mean);
+	}
+	result.stddev = samples.size() > 1 ? std::sqrt(result.stddev / (samples.size() - 1)) : 0;
+
+	auto lower_quartile = get_percentile(samples, 0.25);
+	auto upper_quartile = get_percentile(samples, 0.75);
+	auto fence = 1.5 * (upper_quartile - lower_quartile);
+	for (auto sample : samples) {
+		if (sample < lower_quartile - fence || sample > upper_quartile + fence) {
+			result.outliers++;
+		}
+	}
+	return result;
+}
+
+/*
+* 读取 CPU 的时间戳计数器，不支持时返回 0
+*/
+inline uint64_t read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/*
+* 通过 perf_event_open 读取当前线程的硬件计数器，内核不允许时 is_open 为 false
+*/
+class PerfCounter {
+public:
+	PerfCounter(uint32_t type, uint64_t config) {
+		struct perf_event_attr attribute;
+		memset(&attribute, 0, sizeof(attribute));
+		attribute.size = sizeof(attribute);
+		attribute.type = type;
+		attribute.config = config;
+		attribute.disabled = 1;
+		attribute.exclude_kernel = 1;
+		attribute.exclude_hv = 1;
+		fd = (int) syscall(SYS_perf_event_open, &attribute, 0, -1, -1, 0);
+	}
+
+	~PerfCounter() {
+		if (fd != -1) {
+			close(fd);
+		}
+	}
+
+	PerfCounter(const PerfCounter&) = delete;
+	PerfCounter& operator=(const PerfCounter&) = delete;
+
+	bool is_open() {
+		return fd != -1;
+	}
+
+	void start() {
+		if (fd != -1) {
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+
+	uint64_t stop() {
+		uint64_t count = 0;
+		if (fd != -1) {
+			ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+				count = 0;
+			}
+		}
+		return count;
+	}
+protected:
+	int fd = -1;
+};
+
+/*
+* 边输出边记录，记录的内容超过 limit 后放弃记录，只继续输出
+*/
+class CaptureStreambuf : public std::streambuf {
+public:
+	CaptureStreambuf(std::streambuf* out, size_t limit) : out(out), limit(limit) {}
+
+	const std::string& get_captured() {
+		return captured;
+	}
+
+	bool is_truncated() {
+		return truncated;
+	}
+protected:
+	int overflow(int ch) override {
+		if (traits_type::eq_int_type(ch, traits_type::eof())) {
+			return traits_type::not_eof(ch);
+		}
+		char data = traits_type::to_char_type(ch);
+		capture(&data, 1);
+		return out->sputc(data);
+	}
+
+	std::streamsize xsputn(const char* data, std::streamsize count) override {
+		capture(data, count);
+		return out->sputn(data, count);
+	}
+
+	int sync() override {
+		return out->pubsync();
+	}
+
+	void capture(const char* data, std::streamsize count) {
+		if (truncated) {
+			return;
+		}
+		if (captured.length() + count > limit) {
+			truncated = true;
+			std::string().swap(captured);
+			return;
+		}
+		captured.append(data, count);
+	}
+
+	std::streambuf* out;
+	size_t limit;
+	std::string captured;
+	bool truncated = false;
+};
+
+/*
+* 指令结果缓存：以规范化的指令和其输入文件的 inode、大小、修改时间作为键，把标准输出保存在磁盘上
+* 命中时直接 mmap 缓存文件输出；缓存总大小超过上限时按最近使用时间淘汰
+* 总大小只在第一次写入时扫描目录得到，之后随写入累加，超过上限时才重新扫描并淘汰
+*
+* 缓存文件的格式是：MAGIC、键的长度（8 字节）、键、输出内容
+*/
+class ResultCache {
+public:
+	static constexpr const char* MAGIC = "CWRC1\n";
+	static constexpr size_t MAGIC_LENGTH = 6;
+
+	// 没有 HOME 时不使用共享的临时目录，否则其他用户可以预先放入伪造的结果，此时缓存被禁用
+	ResultCache() {
+		char* path = getenv("CHUANWISE_SHELL_CACHE");
+		char* home = getenv("HOME");
+		if (path && *path) {
+			directory = path;
+		} else if (home && *home) {
+			directory = std::string(home) + "/.cache/chuanwise-shell";
+		}
+	}
+
+	bool is_enabled() {
+		return !directory.empty();
+	}
+
+	void set_directory(std::string directory) {
+		this->directory = directory;
+	}
+
+	std::string get_directory() {
+		return directory;
+	}
+
+	void set_capacity(size_t capacity) {
+		this->capacity = capacity;
+	}
+
+	size_t get_capacity() {
+		return capacity;
+	}
+
+	// 一条输出最多能有多大，超过的输出不会被缓存
+	size_t get_output_limit(const std::string& key) {
+		size_t header_length = MAGIC_LENGTH + sizeof(uint64_t) + key.length();
+		return header_length < capacity ? capacity - header_length : 0;
+	}
+
+	/*
+	* 获得指令的缓存键，input_files 是指令读取的文件
+	* 键包含输入文件的设备号、inode、大小、修改时间和状态改变时间
+	* 任何一个输入文件不存在时返回空字符串，表示不能缓存
+	*/
+	static std::string get_key(Command command, const std::vector<std::string>& input_files) {
+		// 各个部分之间用 '\0' 分隔，它不会出现在参数中
+		std::string key = command.get_head();
+		auto append = [&key](std::string part) {
+			key.push_back('\0');
+			key += part;
+		};
+
+		for (auto& argument : command.get_arguments()) {
+			append(argument);
+		}
+		append("<" + command.get_in_redirection());
+		if (!command.get_out_redirection().empty()) {
+			append(((command.get_out_mode() & std::ios::app) ? ">>" : ">") + command.get_out_redirection());
+		}
+		if (!command.get_err_redirection().empty()) {
+			append(((command.get_err_out_mode() & std::ios::app) ? "2>>" : "2>") + command.get_err_redirection());
+		}
+
+		for (auto& path : input_files) {
+			struct stat status;
+			if (stat(path.c_str(), &status) == -1) {
+				return "";
+			}
+			append("@" + path);
+			append(std::to_string(status.st_dev));
+			append(std::to_string(status.st_ino));
+			append(std::to_string(status.st_size));
+			append(std::to_string(status.st_mtim.tv_sec) + "." + std::to_string(status.st_mtim.tv_nsec));
+			// chmod 等只修改元数据的操作不改变 mtime，但会改变 ctime
+			append(std::to_string(status.st_ctim.tv_sec) + "." + std::to_string(status.st_ctim.tv_nsec));
+		}
+		return key;
+	}
+
+	/*
+	* 命中时把缓存的输出写入 out 并返回 true
+	*/
+	bool replay(const std::string& key, std::streambuf* out) {
+		if (!is_enabled()) {
+			return false;
+		}
+		auto path = get_path(key);
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd == -1) {
+			misses++;
+			return false;
+		}
+
+		struct stat status;
+		bool hit = false;
+		if (fstat(fd, &status) == 0 && (size_t) status.st_size >= MAGIC_LENGTH + sizeof(uint64_t)) {
+			size_t size = status.st_size;
+			auto data = (const char*) mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data != MAP_FAILED) {
+				uint64_t key_length;
+				memcpy(&key_length, data + MAGIC_LENGTH, sizeof(key_length));
+				size_t header_length = MAGIC_LENGTH + sizeof(key_length) + key_length;
+
+				// 哈希相同但键不同的文件视为未命中
+				hit = memcmp(data, MAGIC, MAGIC_LENGTH) == 0
+					&& key_length == key.length()
+					&& header_length <= size
+					&& memcmp(data + MAGIC_LENGTH + sizeof(key_length), key.data(), key.length()) == 0;
+				if (hit) {
+					out->sputn(data + header_length, size - header_length);
 				}
-				buffer.push_back(ch);
-				break;
-			default:
-				throw ShellException("an internal error occurs: illegal state for argument parse FSM");
+				munmap((void*) data, size);
 			}
 		}
+		close(fd);
 
-		// 最后一个参数可能因为循环到结尾而没有纳入
-		if (!buffer.empty()) {
-			if (last_keyword.empty()) {
-				result.emplace_back(buffer);
-			} else {
-				result.emplace_back(last_keyword);
-				result.emplace_back(buffer.substr(last_keyword.length() - 1));
+		if (hit) {
+			// 修改时间作为最近使用时间
+			utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+			hits++;
+		} else {
+			misses++;
+		}
+		return hit;
+	}
+
+	void store(const std::string& key, const std::string& output) {
+		if (!is_enabled() || output.length() > get_output_limit(key) || !make_directories(directory)) {
+			return;
+		}
+
+		// 先写临时文件再改名，避免其他进程读到写了一半的缓存
+		auto path = get_path(key);
+		size_t size = MAGIC_LENGTH + sizeof(uint64_t) + key.length() + output.length();
+		size_t replaced_size = std::max<long long>(get_file_size(path), 0);
+		auto temp_path = path + ".tmp" + std::to_string(getpid());
+		{
+			std::ofstream file(temp_path, std::ios::out | std::ios::trunc | std::ios::binary);
+			uint64_t key_length = key.length();
+			file.write(MAGIC, MAGIC_LENGTH);
+			file.write((const char*) &key_length, sizeof(key_length));
+			file.write(key.data(), key.length());
+			file.write(output.data(), output.length());
+			if (!file.good()) {
+				file.close();
+				unlink(temp_path.c_str());
+				return;
+			}
+		}
+		if (rename(temp_path.c_str(), path.c_str()) == -1) {
+			unlink(temp_path.c_str());
+			return;
+		}
+
+		if (!is_total_size_known) {
+			total_size = 0;
+			for (auto& entry : list_entries()) {
+				total_size += entry.size;
+			}
+			is_total_size_known = true;
+		} else {
+			total_size = total_size + size - std::min(replaced_size, total_size);
+		}
+		if (total_size > capacity) {
+			evict();
+		}
+	}
+
+	void clear() {
+		for (auto& entry : list_entries()) {
+			unlink(entry.path.c_str());
+		}
+		total_size = 0;
+		is_total_size_known = true;
+	}
+
+	size_t get_hits() {
+		return hits;
+	}
+
+	size_t get_misses() {
+		return misses;
+	}
+protected:
+	struct Entry {
+		std::string path;
+		size_t size;
+		struct timespec used_time;
+	};
+
+	std::string get_path(const std::string& key) {
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx.cache", (unsigned long long) get_fnv1a_hash(key));
+		return directory + "/" + name;
+	}
+
+	std::vector<Entry> list_entries() {
+		std::vector<Entry> result;
+		DIR* dir = opendir(directory.c_str());
+		if (!dir) {
+			return result;
+		}
+		while (auto entry = readdir(dir)) {
+			std::string name = entry->d_name;
+			struct stat status;
+			auto path = directory + "/" + name;
+			if (name.length() > 6 && name.compare(name.length() - 6, 6, ".cache") == 0 && stat(path.c_str(), &status) == 0) {
+				result.push_back({ path, (size_t) status.st_size, status.st_mtim });
 			}
 		}
+		closedir(dir);
 		return result;
 	}
+
+	// 总大小超过上限时，删除最久没有使用的缓存，直到只剩下上限的四分之三，避免接下来每次写入都要重新扫描
+	void evict() {
+		auto entries = list_entries();
+		size_t total = 0;
+		for (auto& entry : entries) {
+			total += entry.size;
+		}
+		total_size = total;
+		if (total <= capacity) {
+			return;
+		}
+		size_t target = capacity / 4 * 3;
+
+		std::sort(entries.begin(), entries.end(), [](const Entry& left, const Entry& right) {
+			return left.used_time.tv_sec != right.used_time.tv_sec
+				? left.used_time.tv_sec < right.used_time.tv_sec
+				: left.used_time.tv_nsec < right.used_time.tv_nsec;
+		});
+		for (auto& entry : entries) {
+			if (total <= target) {
+				break;
+			}
+			if (unlink(entry.path.c_str()) == 0) {
+				total -= entry.size;
+			}
+		}
+		total_size = total;
+	}
+
+	std::string directory;
+	size_t capacity = 64 * 1024 * 1024;
+
+	// 缓存目录的大致总大小，其他进程的写入不会计入，淘汰时重新扫描校正
+	size_t total_size = 0;
+	bool is_total_size_known = false;
+
+	size_t hits = 0;
+	size_t misses = 0;
+};
+
+/*
+* 只读的内存 streambuf，直接读取共享的文件内容而不复制
+*/
+class ViewStreambuf : public std::streambuf {
+public:
+	void set_content(std::shared_ptr<const std::string> content) {
+		this->content = content;
+		auto data = const_cast<char*>(content->data());
+		setg(data, data, data + content->length());
+	}
 protected:
-	std::string space = " \n\t\r";
+	std::shared_ptr<const std::string> content;
+};
 
-	std::string board = "\"";
+/*
+* 文件内容缓存：以路径为键，用 statx 得到的设备号、inode、大小和修改时间校验缓存是否有效
+* 总大小超过预算时淘汰最久没有使用的文件；读取结果是共享的只读内容，被淘汰后仍可以继续使用
+*/
+class FileContentCache {
+public:
+	void set_capacity(size_t capacity) {
+		this->capacity = capacity;
+		evict();
+	}
 
-	std::set<std::string> keywords;
+	size_t get_capacity() {
+		return capacity;
+	}
+
+	/*
+	* 读取普通文件的全部内容
+	* 文件不存在、不是普通文件或者超过预算的四分之一时返回 nullptr，调用者应当直接读取文件
+	*/
+	std::shared_ptr<const std::string> read(const std::string& path) {
+		struct statx status;
+		if (statx(AT_FDCWD, path.c_str(), AT_STATX_SYNC_AS_STAT, STATX_TYPE | STATX_INO | STATX_SIZE | STATX_MTIME, &status) == -1
+			|| !S_ISREG(status.stx_mode)) {
+			return nullptr;
+		}
+
+		auto entry = entries.find(path);
+		if (entry != entries.end()) {
+			if (is_same_version(entry->second.status, status)) {
+				hits++;
+				lru.splice(lru.begin(), lru, entry->second.position);
+				return entry->second.content;
+			}
+			erase(entry);
+		}
+		misses++;
+
+		if (status.stx_size > capacity / 4) {
+			return nullptr;
+		}
+		auto content = read_file(path, status);
+		if (!content) {
+			return nullptr;
+		}
+
+		lru.push_front(path);
+		entries[path] = { content, status, lru.begin() };
+		size += content->length();
+		evict();
+		return content;
+	}
+
+	void clear() {
+		entries.clear();
+		lru.clear();
+		size = 0;
+	}
+
+	size_t get_hits() {
+		return hits;
+	}
+
+	size_t get_misses() {
+		return misses;
+	}
+
+	size_t get_size() {
+		return size;
+	}
+
+	size_t get_entry_count() {
+		return entries.size();
+	}
+protected:
+	struct Entry {
+		std::shared_ptr<const std::string> content;
+		struct statx status;
+		std::list<std::string>::iterator position;
+	};
+
+	static bool is_same_version(const struct statx& left, const struct statx& right) {
+		return left.stx_dev_major == right.stx_dev_major
+			&& left.stx_dev_minor == right.stx_dev_minor
+			&& left.stx_ino == right.stx_ino
+			&& left.stx_size == right.stx_size
+			&& left.stx_mtime.tv_sec == right.stx_mtime.tv_sec
+			&& left.stx_mtime.tv_nsec == right.stx_mtime.tv_nsec;
+	}
+
+	// 读取期间文件被修改时不缓存，避免内容和校验信息不一致
+	static std::shared_ptr<const std::string> read_file(const std::string& path, const struct statx& status) {
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd == -1) {
+			return nullptr;
+		}
+
+		auto content = std::make_shared<std::string>();
+		content->resize(status.stx_size);
+		size_t length = 0;
+		while (length < content->length()) {
+			auto count = ::read(fd, &(*content)[length], content->length() - length);
+			if (count <= 0) {
+				break;
+			}
+			length += count;
+		}
+
+		struct statx after_status;
+		bool is_stable = length == content->length()
+			&& statx(fd, "", AT_EMPTY_PATH, STATX_INO | STATX_SIZE | STATX_MTIME, &after_status) == 0
+			&& is_same_version(status, after_status);
+		close(fd);
+		return is_stable ? content : nullptr;
+	}
+
+	void erase(std::unordered_map<std::string, Entry>::iterator entry) {
+		size -= entry->second.content->length();
+		lru.erase(entry->second.position);
+		entries.erase(entry);
+	}
+
+	void evict() {
+		while (size > capacity && !lru.empty()) {
+			erase(entries.find(lru.back()));
+		}
+	}
+
+	std::unordered_map<std::string, Entry> entries;
+	std::list<std::string> lru;
+	size_t size = 0;
+	size_t capacity = 16 * 1024 * 1024;
+
+	size_t hits = 0;
+	size_t misses = 0;
 };
 
 /*
@@ -317,10 +1442,112 @@ public:
 		if (input.empty()) {
 			return true;
 		}
+
+		std::vector<std::string> split_result;
+		{
+			TraceSpan span("split", "split");
+			split_result = spliter.split(input);
+		}
+		return on_tokens(std::move(split_result));
+	}
+
+	/*
+	* 在给定的输入输出下执行一行输入，执行完后恢复当前所有的输入输出状态
+	* 供在指令处理器中再次执行指令的内置指令使用
+	*/
+	bool on_nested_command(std::string input, std::streambuf* cur_in_buffer, std::streambuf* cur_out_buffer, std::streambuf* cur_err_buffer) {
+		// 保存老值
+		auto elder_in_buffer = in_buffer;
+		auto elder_out_buffer = out_buffer;
+		auto elder_err_buffer = err_buffer;
+		auto elder_cin_buffer = cin_buffer;
+		auto elder_cout_buffer = cout_buffer;
+		auto elder_cerr_buffer = cerr_buffer;
+		auto elder_stream_in_buffer = std::cin.rdbuf();
+		auto elder_stream_out_buffer = std::cout.rdbuf();
+		auto elder_stream_err_buffer = std::cerr.rdbuf();
+		auto restore = [&]() {
+			in_buffer = elder_in_buffer;
+			out_buffer = elder_out_buffer;
+			err_buffer = elder_err_buffer;
+			cin_buffer = elder_cin_buffer;
+			cout_buffer = elder_cout_buffer;
+			cerr_buffer = elder_cerr_buffer;
+			std::cin.rdbuf(elder_stream_in_buffer);
+			std::cout.rdbuf(elder_stream_out_buffer);
+			std::cerr.rdbuf(elder_stream_err_buffer);
+		};
+
+		cin_buffer = cur_in_buffer;
+		cout_buffer = cur_out_buffer;
+		cerr_buffer = cur_err_buffer;
+		try {
+			on_command(input);
+		} catch (...) {
+			restore();
+			throw;
+		}
+		restore();
+		return true;
+	}
+
+	/*
+	* 从 stream 中读取一行并边读边解析，不保存整行输入，读完时 tokens 即为这一行的 Token
+	* 如果 line 不为空，原始输入也会被追加到其中
+	* 输入流已经结束且没有读到任何字符时返回 false
+	*/
+	bool read_tokens(std::istream& stream, std::vector<std::string>& tokens, std::string* line = nullptr) {
+		// 读到第一段输入后才开始计时，不包含等待用户输入的时间
+		std::optional<TraceSpan> span;
+		auto on_token = [&tokens](std::string token) {
+			tokens.emplace_back(std::move(token));
+		};
+
+		tokens.clear();
+		if (line) {
+			line->clear();
+		}
+		spliter.reset();
+		read_buffer.resize(READ_CHUNK);
+
+		while (true) {
+			stream.getline(read_buffer.data(), read_buffer.size());
+			auto count = (size_t) stream.gcount();
+			if (!span) {
+				span.emplace("split", "read_tokens");
+			}
+
+			// 读满缓冲区但还没遇到换行符：这一段喂给解析器，然后继续读
+			bool is_partial = stream.fail() && !stream.eof() && count == read_buffer.size() - 1;
+			bool is_end = stream.eof();
+			auto length = is_partial || is_end ? count : count - 1;
+
+			spliter.feed(read_buffer.data(), length, on_token);
+			if (line) {
+				line->append(read_buffer.data(), length);
+			}
+			if (is_partial) {
+				stream.clear();
+				continue;
+			}
+
+			spliter.finish(on_token);
+			return !is_end || count > 0;
+		}
+	}
+
+	bool on_tokens(std::vector<std::string> split_result) {
+		if (split_result.empty()) {
+			return true;
+		}
 		restore_buffers();
+		TraceSpan pipeline_span("shell", "on_command");
 
-		auto split_result = spliter.split(input);
-		auto contexts = to_commands(split_result);
+		std::vector<Command> contexts;
+		{
+			TraceSpan span("parse", "to_commands");
+			contexts = to_commands(split_result);
+		}
 
 		if (contexts.size() == 1) {
 			on_command(contexts[0]);
@@ -359,6 +1586,7 @@ public:
 				auto last_err_redirection = last_command.get_err_redirection();
 				std::ofstream err_file;
 				if (!last_err_redirection.empty()) {
+					TraceSpan span("redirection", [&]() { return "open err: " + last_err_redirection; });
 					err_file.open(last_err_redirection, last_command.get_err_out_mode());
 					if (err_file.is_open()) {
 						err_buffer = err_file.rdbuf();
@@ -368,7 +1596,10 @@ public:
 					}
 				}
 
-				on_command(last_command);
+				{
+					TraceSpan span("shell", [&]() { return "stage: " + last_command.get_head(); });
+					on_command(last_command);
+				}
 
 				// 不断交换 in 和 out
 				if ((p - contexts.begin()) & 1) {
@@ -379,6 +1610,7 @@ public:
 
 				// 如果有 err 重定向，保存文件
 				if (err_file.is_open()) {
+					TraceSpan span("redirection", [&]() { return "close err: " + last_err_redirection; });
 					err_file.close();
 				}
 			}
@@ -392,6 +1624,7 @@ public:
 			}
 
 			out_buffer = cout_buffer;
+			TraceSpan span("shell", [&]() { return "stage: " + back_command.get_head(); });
 			on_command(back_command);
 		}
 		restore_buffers();
@@ -404,11 +1637,20 @@ public:
 		auto out_redirection = command.get_out_redirection();
 		auto err_redirection = command.get_err_redirection();
 
+		// 能缓存的文件直接读取缓存中的内容
 		std::ifstream in_file;
+		ViewStreambuf in_view_buffer;
 		if (!in_redirection.empty()) {
-			in_file.open(in_redirection, std::ios::in);
-			if (in_file.is_open()) {
-				in_buffer = in_file.rdbuf();
+			TraceSpan span("redirection", [&]() { return "open in: " + in_redirection; });
+			auto content = file_cache.read(in_redirection);
+			if (content) {
+				in_view_buffer.set_content(content);
+				in_buffer = &in_view_buffer;
+			} else {
+				in_file.open(in_redirection, std::ios::in);
+				if (in_file.is_open()) {
+					in_buffer = in_file.rdbuf();
+				}
 			}
 		}
 
@@ -417,6 +1659,7 @@ public:
 			if (out_redirection == "&2") {
 				out_buffer = err_buffer;
 			} else if (out_redirection != "&1") {
+				TraceSpan span("redirection", [&]() { return "open out: " + out_redirection; });
 				out_file.open(out_redirection, command.get_out_mode());
 				if (out_file.is_open()) {
 					out_buffer = out_file.rdbuf();
@@ -431,6 +1674,7 @@ public:
 			if (err_redirection == "&1") {
 				err_buffer = in_buffer;
 			} else if (err_redirection != "&2") {
+				TraceSpan span("redirection", [&]() { return "open err: " + err_redirection; });
 				err_file.open(err_redirection, command.get_err_out_mode());
 				if (err_file.is_open()) {
 					err_buffer = err_file.rdbuf();
@@ -443,14 +1687,17 @@ public:
 		execute_in_current_env(command);
 
 		// 关闭重定向的文件
-		if (in_file.is_open()) {
-			in_file.close();
-		}
-		if (out_file.is_open()) {
-			out_file.close();
-		}
-		if (err_file.is_open()) {
-			err_file.close();
+		if (in_file.is_open() || out_file.is_open() || err_file.is_open()) {
+			TraceSpan span("redirection", "close");
+			if (in_file.is_open()) {
+				in_file.close();
+			}
+			if (out_file.is_open()) {
+				out_file.close();
+			}
+			if (err_file.is_open()) {
+				err_file.close();
+			}
 		}
 
 		restore_buffers();
@@ -468,9 +1715,13 @@ public:
 		std::cerr.rdbuf(err_buffer);
 
 		// 执行指令
+		TraceSpan span("executor", [&]() { return command.get_head(); });
+		MemoryScope memory_scope(command.get_head());
 		auto executor = executors.find(command.get_head());
 		if (executor == executors.end()) {
 			on_unknown_command(command);
+		} else if (is_pure_command(command.get_head())) {
+			execute_cached(command, executor->second);
 		} else {
 			executor->second(command);
 		}
@@ -496,19 +1747,81 @@ public:
 		std::cerr.rdbuf(err_buffer);
 	}
 
-	virtual void on_unknown_command(Command command) = 0;
+	virtual void on_unknown_command(Command command) = 0;
+
+	bool has_command(std::string head) {
+		return executors.find(head) != executors.end();
+	}
+
+	/*
+	* pure 表示指令的输出只取决于参数和它读取的文件，并且没有其他副作用
+	* 这样的指令在有输入文件时会自动缓存结果，也只有这样的指令可以用 cache 缓存
+	*/
+	bool register_command(std::string head, std::function<void(Command)> executor, bool pure = false) {
+		if (has_command(head)) {
+			return false;
+		} else {
+			executors[head] = executor;
+			if (pure) {
+				pure_commands.insert(head);
+			}
+			return true;
+		}
+	}
+
+	bool is_pure_command(std::string head) {
+		return pure_commands.find(head) != pure_commands.end();
+	}
+
+	/*
+	* 通过结果缓存执行指令，只缓存读取了文件的指令
+	* 读取标准输入（终端或管道）的指令的输入无法作为键，总是直接执行
+	*/
+	void execute_cached(Command command, const std::function<void(Command)>& executor) {
+		bool is_from_stdin = command.get_in_redirection().empty() && in_buffer != cin_buffer;
+		auto input_files = get_input_files(command);
+		auto key = !result_cache.is_enabled() || is_from_stdin || input_files.empty()
+			? "" : ResultCache::get_key(command, input_files);
+		if (key.empty()) {
+			executor(command);
+			return;
+		}
+
+		TraceSpan span("cache", [&]() { return command.get_head(); });
+		if (result_cache.replay(key, std::cout.rdbuf())) {
+			return;
+		}
+
+		// 未命中时边输出边记录，执行成功后再写入缓存，输出太大时不记录
+		CaptureStreambuf capture_buffer(std::cout.rdbuf(), result_cache.get_output_limit(key));
+		auto elder_out_buffer = std::cout.rdbuf(&capture_buffer);
+		is_command_failed = false;
+		try {
+			executor(command);
+		} catch (...) {
+			std::cout.rdbuf(elder_out_buffer);
+			throw;
+		}
+		std::cout.flush();
+		std::cout.rdbuf(elder_out_buffer);
+		if (!capture_buffer.is_truncated() && !is_command_failed) {
+			result_cache.store(key, capture_buffer.get_captured());
+		}
+	}
+
+	/*
+	* 执行器遇到错误（例如文件无法读取）时调用，这次执行的输出不会被缓存
+	*/
+	void set_command_failed() {
+		is_command_failed = true;
+	}
 
-	bool has_command(std::string head) {
-		return executors.find(head) != executors.end();
+	ResultCache& get_result_cache() {
+		return result_cache;
 	}
 
-	bool register_command(std::string head, std::function<void(Command)> executor) {
-		if (has_command(head)) {
-			return false;
-		} else {
-			executors[head] = executor;
-			return true;
-		}
+	FileContentCache& get_file_cache() {
+		return file_cache;
 	}
 
 	Spliter& get_spliter() {
@@ -519,6 +1832,28 @@ public:
 		this->spliter = spliter;
 	}
 
+	/*
+	* 指令读取的文件：输入重定向，以及作为参数出现的普通文件
+	*/
+	std::vector<std::string> get_input_files(Command command) {
+		std::vector<std::string> result;
+		if (!command.get_in_redirection().empty()) {
+			result.emplace_back(command.get_in_redirection());
+		}
+
+		auto arguments = command.get_arguments();
+		if (arguments.size() > 1) {
+			// cat 等指令把全部参数当作一个文件名
+			arguments.emplace_back(command.get_remain_arguments());
+		}
+		for (auto& argument : arguments) {
+			if (get_file_size(argument) >= 0) {
+				result.emplace_back(argument);
+			}
+		}
+		return result;
+	}
+
 	std::vector<Command> to_commands(std::vector<std::string> tokens) {
 		std::vector<Command> result;
 		std::vector<std::string> cur_tokens;
@@ -632,17 +1967,42 @@ public:
 	const std::unordered_map<std::string, std::function<void(Command)>>& get_executors() {
 		return executors;
 	}
+
+	// 用户名只在第一次使用时查询，uid 在 shell 运行期间不会改变；主机名可能被修改，每次都重新获取
+	std::string get_prompt_user_name() {
+		if (prompt_user_name.empty()) {
+			prompt_user_name = get_user_name();
+		}
+		return prompt_user_name;
+	}
+
+	std::string get_prompt() {
+		return get_prompt_user_name() + "@" + get_host_name() + ":" + get_working_path() + "$ ";
+	}
 protected:
 	std::unordered_map<std::string, std::function<void(Command)>> executors;
+	std::set<std::string> pure_commands;
 	Spliter spliter;
+	ResultCache result_cache;
+	FileContentCache file_cache;
+
+	// 当前执行的指令是否报告了错误，由 execute_cached 在执行前清除
+	bool is_command_failed = false;
+
+	std::string prompt_user_name;
+
+	// 流式读取输入时每次最多读入的字节数
+	static constexpr size_t READ_CHUNK = 64 * 1024;
+	std::vector<char> read_buffer;
+
+	// 没有重定向时的输入输出，只有 on_nested_command 执行期间会被替换
+	std::streambuf* cin_buffer = std::cin.rdbuf();
+	std::streambuf* cout_buffer = std::cout.rdbuf();
+	std::streambuf* cerr_buffer = std::cerr.rdbuf();
 
 	std::streambuf* in_buffer = cin_buffer;
 	std::streambuf* out_buffer = cout_buffer;
 	std::streambuf* err_buffer = cerr_buffer;
-
-	std::streambuf* const cin_buffer = std::cin.rdbuf();
-	std::streambuf* const cout_buffer = std::cout.rdbuf();
-	std::streambuf* const cerr_buffer = std::cerr.rdbuf();
 };
 
 /*
@@ -693,13 +2053,17 @@ private:
 		* cat
 		* show the content of a text file
 		*/
-		register_command("cat", [](Command command) {
+		// 文件内容由内存中的文件缓存提供，在磁盘上再缓存一份输出没有好处，所以不声明为 pure
+		register_command("cat", [this](Command command) {
 			std::string file_name = command.get_remain_arguments();
+			auto content = file_name.empty() ? nullptr : get_file_cache().read(file_name);
 			if (file_name.empty()) {
 				char ch;
 				while ((ch = std::cin.get()) != EOF) {
 					std::cout << ch;
 				}
+			} else if (content) {
+				std::cout.write(content->data(), content->length());
 			} else {
 				std::ifstream file;
 				file.open(file_name);
@@ -711,6 +2075,7 @@ private:
 					file.close();
 				} else {
 					std::cout << "cat: " << file_name << ": No such file or directory" << std::endl;
+					set_command_failed();
 				}
 			}
 		});
@@ -719,7 +2084,13 @@ private:
 		* vi. help
 		* Display the user manual using the more filter.
 		*/
-		register_command("help", [](Command command) {
+		register_command("help", [this](Command command) {
+			auto content = get_file_cache().read("help.txt");
+			if (content) {
+				std::cout.write(content->data(), content->length());
+				return;
+			}
+
 			std::ifstream file;
 			file.open("help.txt");
 			if (file.is_open()) {
@@ -782,10 +2153,643 @@ private:
 		register_command("ls", [](Command command) {
 			system(command.to_original_string().c_str());
 		});
+
+		/*
+		* cache [--clear | <command>]
+		* 缓存指令的标准输出，指令和输入文件都没有变化时直接输出上次的结果
+		* 命中时只会重放标准输出，因此有副作用或者读取标准输入的指令不缓存，直接执行
+		*/
+		register_command("cache", [this](Command command) {
+			auto& result_cache = get_result_cache();
+			auto& file_cache = get_file_cache();
+			auto arguments = command.get_arguments();
+			if (arguments.empty()) {
+				std::cout << "cache: " << (result_cache.is_enabled() ? result_cache.get_directory() : "disabled")
+					<< ", hits: " << result_cache.get_hits()
+					<< ", misses: " << result_cache.get_misses() << std::endl
+					<< "file cache: " << file_cache.get_entry_count() << " files, " << file_cache.get_size() << " bytes"
+					<< ", hits: " << file_cache.get_hits()
+					<< ", misses: " << file_cache.get_misses() << std::endl;
+				return;
+			}
+			if (arguments.size() == 1 && arguments[0] == "--clear") {
+				result_cache.clear();
+				file_cache.clear();
+				return;
+			}
+
+			// 去掉 cache 前缀，重定向保持不变
+			Command target(arguments);
+			target.set_in_redirection(command.get_in_redirection());
+			target.set_out_redirection(command.get_out_redirection());
+			target.set_out_mode(command.get_out_mode());
+			target.set_err_redirection(command.get_err_redirection());
+			target.set_err_out_mode(command.get_err_out_mode());
+
+			auto& executors = get_executors();
+			auto executor = executors.find(target.get_head());
+			if (executor == executors.end()) {
+				on_unknown_command(target);
+			} else if (!is_pure_command(target.get_head())) {
+				std::cerr << "cache: " << target.get_head() << ": not a pure command, run without cache" << std::endl;
+				executor->second(target);
+			} else if (get_input_files(target).empty()) {
+				std::cerr << "cache: " << target.get_head() << ": reads standard input, run without cache" << std::endl;
+				executor->second(target);
+			} else {
+				execute_cached(target, executor->second);
+			}
+		});
+
+		/*
+		* bench [-n N] [-w warmup] <command line>
+		* 重复执行一行输入并统计耗时，输出全部丢弃，不包含进程启动的时间
+		*/
+		register_command("bench", [this](Command command) {
+			auto arguments = command.get_arguments();
+			int runs = 100;
+			int warmup = 3;
+			size_t index = 0;
+			try {
+				for (; index + 1 < arguments.size() && (arguments[index] == "-n" || arguments[index] == "-w"); index += 2) {
+					(arguments[index] == "-n" ? runs : warmup) = std::stoi(arguments[index + 1]);
+				}
+			} catch (std::exception& exception) {
+				runs = 0;
+			}
+			if (index >= arguments.size() || runs <= 0 || warmup < 0) {
+				std::cerr << "usage: bench [-n N] [-w warmup] <command line>" << std::endl;
+				return;
+			}
+
+			// 只有一个参数时它就是整行输入，例如 bench "echo qwq | cat"
+			auto input = index + 1 == arguments.size() ? arguments[index] : command.get_remain_arguments(index);
+
+			NullStreambuf null_buffer;
+			std::stringbuf empty_buffer;
+			std::vector<double> times;
+			std::vector<double> cycles;
+			std::vector<double> instruction_counts;
+			std::vector<double> cache_miss_counts;
+			PerfCounter instructions(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+			PerfCounter cache_misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+
+			{
+				DiscardedOutputFds discarded_output_fds;
+				for (int run = 0; run < warmup; run++) {
+					on_nested_command(input, &empty_buffer, &null_buffer, &null_buffer);
+				}
+
+				for (int run = 0; run < runs; run++) {
+					instructions.start();
+					cache_misses.start();
+					auto begin_cycles = read_cycles();
+					auto begin = std::chrono::steady_clock::now();
+
+					on_nested_command(input, &empty_buffer, &null_buffer, &null_buffer);
+
+					auto end = std::chrono::steady_clock::now();
+					auto end_cycles = read_cycles();
+					instruction_counts.emplace_back(instructions.stop());
+					cache_miss_counts.emplace_back(cache_misses.stop());
+					times.emplace_back(std::chrono::duration<double, std::micro>(end - begin).count());
+					cycles.emplace_back(end_cycles - begin_cycles);
+				}
+			}
+
+			auto time = get_statistics(times);
+			std::cout << "bench: " << input << std::endl
+				<< "runs: " << runs << " (warmup " << warmup << ")" << std::endl
+				<< "time (us): min " << time.min << ", median " << time.median << ", p99 " << time.p99
+				<< ", mean " << time.mean << ", stddev " << time.stddev << std::endl
+				<< "outliers: " << time.outliers << " (" << 100.0 * time.outliers / runs << "%)" << std::endl;
+			if (cycles.back() > 0) {
+				std::cout << "cycles: median " << (uint64_t) get_statistics(cycles).median << std::endl;
+			}
+			if (instructions.is_open()) {
+				std::cout << "instructions: median " << (uint64_t) get_statistics(instruction_counts).median << std::endl;
+			}
+			if (cache_misses.is_open()) {
+				std::cout << "cache misses: median " << (uint64_t) get_statistics(cache_miss_counts).median << std::endl;
+			}
+			if (!instructions.is_open() && !cache_misses.is_open()) {
+				std::cout << "perf counters: unavailable" << std::endl;
+			}
+		});
+
+		/*
+		* memstats [--reset]
+		* 按指令头报告内存分配次数、分配字节数、仍未释放的字节数和峰值
+		*/
+		register_command("memstats", [](Command command) {
+			auto& accounting = MemoryAccounting::get_instance();
+			if (!MemoryAccounting::ENABLED) {
+				std::cout << "memstats: memory accounting is disabled, rebuild with -DCHUANWISE_SHELL_MEMSTATS" << std::endl;
+				return;
+			}
+
+			auto arguments = command.get_arguments();
+			if (arguments.size() == 1 && arguments[0] == "--reset") {
+				accounting.reset();
+				return;
+			}
+
+			auto counters = accounting.get_counters();
+			counters.emplace(counters.begin(), "<total>", &MemoryAccounting::get_total_counter());
+			std::cout << "command\tallocations\tbytes\tlive\tpeak" << std::endl;
+			for (auto& entry : counters) {
+				auto counter = entry.second;
+				std::cout << entry.first
+					<< "\t" << counter->allocations.load(std::memory_order_relaxed)
+					<< "\t" << counter->allocated_bytes.load(std::memory_order_relaxed)
+					<< "\t" << counter->live_bytes.load(std::memory_order_relaxed)
+					<< "\t" << counter->peak_bytes.load(std::memory_order_relaxed) << std::endl;
+			}
+		});
+
+		/*
+		* trace [on|off|clear|dump <file>]
+		* 记录各执行阶段的时间区间，导出为 Chrome trace JSON，可以用 Perfetto 打开
+		*/
+		register_command("trace", [](Command command) {
+			auto& tracer = Tracer::get_instance();
+			auto arguments = command.get_arguments();
+			if (arguments.empty()) {
+				std::cout << "trace: " << (tracer.is_enabled() ? "on" : "off") << std::endl;
+			} else if (arguments[0] == "on") {
+				tracer.set_enabled(true);
+			} else if (arguments[0] == "off") {
+				tracer.set_enabled(false);
+			} else if (arguments[0] == "clear") {
+				tracer.clear();
+			} else if (arguments[0] == "dump" && arguments.size() == 2) {
+				if (!tracer.export_chrome_trace(arguments[1])) {
+					std::cerr << "trace: " << arguments[1] << ": Can not write trace file" << std::endl;
+				}
+			} else {
+				std::cerr << "usage: trace [on|off|clear|dump <file>]" << std::endl;
+			}
+		});
+	}
+};
+
+/*
+* 注册测试用的指令
+*/
+void register_test_commands(Shell& shell) {
+	shell.register_command("printerr", [](Command command) {
+		std::cout << "cout" << std::endl;
+		std::cerr << "cerr" << std::endl;
+	});
+
+	shell.register_command("repeat", [](Command command) {
+		auto arguments = command.get_remain_arguments();
+		if (!arguments.empty()) {
+			std::cout << "arguments: \"" << arguments << "\"" << std::endl;
+		}
+		std::string input;
+		std::getline(std::cin, input);
+		std::cout << "your input is: \"" << input << "\"" << std::endl;
+	});
+}
+
+/*
+* 会话中的一行输入，以及它执行前的输入重定向文件大小
+*/
+struct SessionLine {
+	long long offset_us = 0;
+	std::vector<std::pair<std::string, long long>> input_files;
+	std::string input;
+};
+
+/*
+* 录制会话：记录每行输入、它相对会话开始的时间，以及输入重定向文件的大小
+*
+* 文件格式是按行的文本，每行输入前面是它的时间和输入文件：
+* T <offset_us>
+* F < <size> <path>
+* L <input>
+*/
+class SessionRecorder {
+public:
+	explicit SessionRecorder(Shell& shell) : shell(shell) {}
+
+	bool open(std::string path) {
+		file.open(path, std::ios::out | std::ios::trunc);
+		if (!file.is_open()) {
+			return false;
+		}
+		file << "# chuanwise-shell session v1" << std::endl;
+		begin = std::chrono::steady_clock::now();
+		return true;
+	}
+
+	bool is_open() {
+		return file.is_open();
+	}
+
+	// 执行前调用，立即落盘，这样 quit 直接退出时也不会丢失这一行
+	void before_command(const std::string& input) {
+		if (!file.is_open() || input.empty()) {
+			return;
+		}
+
+		file << "T " << std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count() << "\n";
+		try {
+			for (auto& command : shell.to_commands(shell.get_spliter().split(input))) {
+				auto in_redirection = command.get_in_redirection();
+				auto size = in_redirection.empty() ? -1 : get_file_size(in_redirection);
+				if (size >= 0) {
+					file << "F < " << size << " " << in_redirection << "\n";
+				}
+			}
+		} catch (ShellException& exception) {
+			// 解析失败的输入同样要录制，执行时会再报告错误
+		}
+		file << "L " << input << std::endl;
+	}
+
+protected:
+	Shell& shell;
+	std::ofstream file;
+	std::chrono::steady_clock::time_point begin;
+};
+
+/*
+* 在临时沙盒目录中确定性地重放录制的会话
+* 不复现录制时的输入间隔，输入重定向的文件在沙盒中按录制的大小用固定内容生成
+*
+* 载入时会改写输入，使重放只能写沙盒内的文件：
+* 绝对路径和含 .. 的重定向目标被映射为沙盒中的文件，含 cd 的行和参数带有 shell 元字符的 ls 被跳过
+* 结果缓存也放在沙盒中，不会读写用户真实的缓存
+*/
+class SessionReplayer {
+public:
+	bool load(std::string path) {
+		std::ifstream file(path);
+		if (!file.is_open()) {
+			return false;
+		}
+
+		// 只用于按 LinuxShell 的关键字分词
+		LinuxShell shell;
+		SessionLine line;
+		std::string text;
+		while (std::getline(file, text)) {
+			if (text.length() < 2 || text[1] != ' ') {
+				continue;
+			}
+			auto content = text.substr(2);
+			if (text[0] == 'T') {
+				line.offset_us = std::stoll(content);
+			} else if (text[0] == 'F' && content.length() > 2 && content[0] == '<') {
+				std::istringstream stream(content.substr(2));
+				long long size;
+				std::string file_path;
+				stream >> size;
+				std::getline(stream >> std::ws, file_path);
+				line.input_files.emplace_back(file_path, size);
+			} else if (text[0] == 'L') {
+				line.input = confine_input(shell, content);
+				if (line.input.empty()) {
+					skipped_line_count++;
+				} else {
+					for (auto& input_file : line.input_files) {
+						input_file.first = confine_path(input_file.first);
+					}
+					lines.emplace_back(line);
+				}
+				line = SessionLine();
+			}
+		}
+		return true;
+	}
+
+	size_t get_line_count() {
+		return lines.size();
+	}
+
+	/*
+	* 在当前进程中重放 rounds 轮，报告每种指令的延迟百分位数和总吞吐量
+	*/
+	void replay(int rounds, std::ostream& report) {
+		std::map<std::string, std::vector<double>> latencies;
+		std::vector<double> totals;
+		int errors = 0;
+
+		for (int round = 0; round < rounds; round++) {
+			auto sandbox = create_sandbox();
+			auto elder_path = get_working_path();
+			chdir(sandbox.c_str());
+			SandboxEnvironment sandbox_environment(sandbox);
+
+			// 输出全部丢弃，输入为空，这样读取标准输入的指令不会阻塞
+			NullStreambuf null_buffer;
+			std::stringbuf empty_buffer;
+			auto elder_in_buffer = std::cin.rdbuf(&empty_buffer);
+			auto elder_out_buffer = std::cout.rdbuf(&null_buffer);
+			auto elder_err_buffer = std::cerr.rdbuf(&null_buffer);
+
+			double total = 0;
+			{
+				DiscardedOutputFds discarded_output_fds;
+				LinuxShell shell;
+				register_test_commands(shell);
+
+				for (auto& line : lines) {
+					auto key = get_key(shell, line.input);
+					if (key == "quit") {
+						break;
+					}
+
+					auto begin = std::chrono::steady_clock::now();
+					try {
+						shell.on_command(line.input);
+					} catch (ShellException& exception) {
+						errors++;
+					}
+					double latency = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+					latencies[key].emplace_back(latency);
+					total += latency;
+				}
+			}
+			totals.emplace_back(total);
+
+			std::cin.rdbuf(elder_in_buffer);
+			std::cout.rdbuf(elder_out_buffer);
+			std::cerr.rdbuf(elder_err_buffer);
+			chdir(elder_path.c_str());
+			remove_sandbox(sandbox);
+		}
+
+		std::sort(totals.begin(), totals.end());
+		auto median_total = get_percentile(totals, 0.5);
+
+		report << lines.size() << " lines x " << rounds << " rounds, " << errors << " errors, "
+			<< skipped_line_count << " lines skipped" << std::endl
+			<< "total: " << median_total / 1000 << " ms (median), throughput: "
+			<< (median_total > 0 ? lines.size() * 1e6 / median_total : 0) << " lines/s" << std::endl
+			<< "command\tcount\tp50(us)\tp90(us)\tp99(us)\tmax(us)" << std::endl;
+		for (auto& entry : latencies) {
+			auto& samples = entry.second;
+			std::sort(samples.begin(), samples.end());
+			report << entry.first << "\t" << samples.size()
+				<< "\t" << get_percentile(samples, 0.5)
+				<< "\t" << get_percentile(samples, 0.9)
+				<< "\t" << get_percentile(samples, 0.99)
+				<< "\t" << samples.back() << std::endl;
+		}
+	}
+
+	/*
+	* 把会话作为标准输入交替喂给两个可执行文件，比较总耗时
+	* 两者都在独立的新沙盒中运行，统计包含进程启动的时间，因此只适合比较整体吞吐量
+	*/
+	bool compare(std::string baseline, std::string candidate, int rounds, std::ostream& report) {
+		char input_path[] = "/tmp/chuanwise-shell-session-XXXXXX";
+		int input_fd = mkstemp(input_path);
+		if (input_fd == -1) {
+			return false;
+		}
+		{
+			std::ofstream input_file(input_path, std::ios::out | std::ios::trunc);
+			for (auto& line : lines) {
+				input_file << line.input << "\n";
+			}
+		}
+
+		std::vector<double> baseline_totals;
+		std::vector<double> candidate_totals;
+		bool success = true;
+		for (int round = 0; round < rounds && success; round++) {
+			success = run_binary(baseline, input_fd, baseline_totals)
+				&& run_binary(candidate, input_fd, candidate_totals);
+		}
+		close(input_fd);
+		unlink(input_path);
+		if (!success) {
+			return false;
+		}
+
+		std::sort(baseline_totals.begin(), baseline_totals.end());
+		std::sort(candidate_totals.begin(), candidate_totals.end());
+		auto baseline_median = get_percentile(baseline_totals, 0.5);
+		auto candidate_median = get_percentile(candidate_totals, 0.5);
+
+		report << lines.size() << " lines x " << rounds << " rounds, " << skipped_line_count << " lines skipped" << std::endl
+			<< "binary\tmin(ms)\tmedian(ms)\tlines/s" << std::endl;
+		for (auto& entry : { std::make_pair(baseline, &baseline_totals), std::make_pair(candidate, &candidate_totals) }) {
+			auto median = get_percentile(*entry.second, 0.5);
+			report << entry.first << "\t" << entry.second->front() << "\t" << median
+				<< "\t" << (median > 0 ? lines.size() * 1e3 / median : 0) << std::endl;
+		}
+		report << "candidate / baseline: " << (baseline_median > 0 ? candidate_median / baseline_median : 0) << std::endl;
+		return true;
+	}
+protected:
+	static bool is_redirection(const std::string& token) {
+		return token == ">" || token == ">>" || token == "1>" || token == "1>>"
+			|| token == "2>" || token == "2>>" || token == "<";
+	}
+
+	// 绝对路径和含 .. 的路径映射为沙盒中的一个文件名
+	static std::string confine_path(std::string path) {
+		if (path.empty() || (path[0] != '/' && path.find("..") == std::string::npos)) {
+			return path;
+		}
+		std::replace(path.begin(), path.end(), '/', '_');
+		for (auto position = path.find(".."); position != std::string::npos; position = path.find("..")) {
+			path.replace(position, 2, "__");
+		}
+		return path;
+	}
+
+	/*
+	* 改写一行输入，使它只能影响沙盒，不能安全重放的行返回空字符串
+	*/
+	static std::string confine_input(Shell& shell, const std::string& input) {
+		std::vector<std::string> tokens;
+		try {
+			tokens = shell.get_spliter().split(input);
+		} catch (std::exception& exception) {
+			return "";
+		}
+
+		std::string result;
+		std::string head;
+		for (size_t index = 0; index < tokens.size(); index++) {
+			auto token = tokens[index];
+			if (head.empty()) {
+				head = token;
+			}
+			if (token == "|") {
+				head.clear();
+			}
+
+			// cd 会离开沙盒；ls 通过 system 执行，参数会被 shell 解释
+			bool is_target = index > 0 && is_redirection(tokens[index - 1]);
+			bool is_argument = token != "|" && !is_redirection(token) && !is_target;
+			if (head == "cd" || (head == "ls" && is_argument && token.find_first_of(";&|`$()<>\\'\"*?!{}~") != std::string::npos)) {
+				return "";
+			}
+			if (is_target && token[0] != '&') {
+				token = confine_path(token);
+			}
+
+			bool need_quote = token.empty() || token.find_first_of(" \t") != std::string::npos;
+			result += (result.empty() ? "" : " ") + (need_quote ? "\"" + token + "\"" : token);
+		}
+		return result;
+	}
+
+	// 以管道中每个指令的指令头作为统计的键
+	static std::string get_key(Shell& shell, const std::string& input) {
+		std::string key;
+		try {
+			for (auto& command : shell.to_commands(shell.get_spliter().split(input))) {
+				key += (key.empty() ? "" : " | ") + command.get_head();
+			}
+		} catch (ShellException& exception) {
+			key = "<error>";
+		}
+		return key.empty() ? "<empty>" : key;
 	}
+
+	/*
+	* 在作用域内把结果缓存的路径指向沙盒，离开时恢复原来的环境变量
+	*/
+	class SandboxEnvironment {
+	public:
+		SandboxEnvironment(std::string sandbox) {
+			set("CHUANWISE_SHELL_CACHE", sandbox + "/.chuanwise-shell-cache");
+		}
+
+		~SandboxEnvironment() {
+			for (auto& variable : elder_variables) {
+				if (variable.second.first) {
+					setenv(variable.first.c_str(), variable.second.second.c_str(), 1);
+				} else {
+					unsetenv(variable.first.c_str());
+				}
+			}
+		}
+	protected:
+		void set(std::string name, std::string value) {
+			char* elder_value = getenv(name.c_str());
+			elder_variables[name] = { elder_value != nullptr, elder_value ? elder_value : "" };
+			setenv(name.c_str(), value.c_str(), 1);
+		}
+
+		std::map<std::string, std::pair<bool, std::string>> elder_variables;
+	};
+
+	std::string create_sandbox() {
+		char path[] = "/tmp/chuanwise-shell-replay-XXXXXX";
+		if (!mkdtemp(path)) {
+			throw ShellException("can not create the replay sandbox");
+		}
+		std::string sandbox = path;
+
+		// 按录制的大小生成输入文件，内容固定以保证每次重放一致
+		for (auto& line : lines) {
+			for (auto& input_file : line.input_files) {
+				auto& file_path = input_file.first;
+				if (file_path.empty()) {
+					continue;
+				}
+				std::ofstream file(sandbox + "/" + file_path, std::ios::out | std::ios::trunc);
+				for (long long index = 0; index < input_file.second; index++) {
+					file.put(index % 64 == 63 ? '\n' : 'a' + index % 26);
+				}
+			}
+		}
+		return sandbox;
+	}
+
+	static void remove_sandbox(std::string sandbox) {
+		nftw(sandbox.c_str(), [](const char* path, const struct stat* status, int flag, struct FTW* ftw) {
+			return remove(path);
+		}, 16, FTW_DEPTH | FTW_PHYS);
+	}
+
+	bool run_binary(std::string binary, int input_fd, std::vector<double>& totals) {
+		auto sandbox = create_sandbox();
+		auto begin = std::chrono::steady_clock::now();
+
+		pid_t pid = fork();
+		if (pid == 0) {
+			int null_fd = open("/dev/null", O_WRONLY);
+			if (chdir(sandbox.c_str()) == -1 || null_fd == -1) {
+				_exit(127);
+			}
+			// 子进程会直接 exec，不需要恢复环境变量；追踪文件也不应该被重放覆盖
+			SandboxEnvironment sandbox_environment(sandbox);
+			unsetenv("CHUANWISE_SHELL_TRACE");
+			lseek(input_fd, 0, SEEK_SET);
+			dup2(input_fd, STDIN_FILENO);
+			dup2(null_fd, STDOUT_FILENO);
+			dup2(null_fd, STDERR_FILENO);
+			execl(binary.c_str(), binary.c_str(), (char*) nullptr);
+			_exit(127);
+		}
+
+		int status = 0;
+		bool success = pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) != 127;
+		totals.emplace_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count());
+		remove_sandbox(sandbox);
+		return success;
+	}
+
+	std::vector<SessionLine> lines;
+	size_t skipped_line_count = 0;
 };
 
-int main() {
+int main(int argc, char** argv) {
+	std::string record_path;
+	std::string replay_path;
+	std::string baseline_binary;
+	std::string candidate_binary;
+	int rounds = 5;
+	for (int index = 1; index < argc; index++) {
+		std::string argument = argv[index];
+		if (argument == "--record" && index + 1 < argc) {
+			record_path = argv[++index];
+		} else if (argument == "--replay" && index + 1 < argc) {
+			replay_path = argv[++index];
+		} else if (argument == "--rounds" && index + 1 < argc) {
+			rounds = std::max(1, atoi(argv[++index]));
+		} else if (argument == "--compare" && index + 2 < argc) {
+			baseline_binary = argv[++index];
+			candidate_binary = argv[++index];
+		} else {
+			std::cerr << "usage: " << argv[0] << " [--record <session>] [--replay <session> [--rounds N] [--compare <baseline> <candidate>]]" << std::endl;
+			return 1;
+		}
+	}
+
+	// 重放模式：不进入交互，报告结果后退出
+	if (!replay_path.empty()) {
+		SessionReplayer replayer;
+		if (!replayer.load(replay_path)) {
+			std::cerr << "Can not open the session file: " << replay_path << std::endl;
+			return 1;
+		}
+		freopen("/dev/null", "r", stdin);
+
+		try {
+			if (baseline_binary.empty()) {
+				replayer.replay(rounds, std::cout);
+			} else if (!replayer.compare(baseline_binary, candidate_binary, rounds, std::cout)) {
+				std::cerr << "Can not run " << baseline_binary << " or " << candidate_binary << std::endl;
+				return 1;
+			}
+		} catch (ShellException& exception) {
+			std::cerr << "ERROR: " << exception.what() << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
 	static const std::string LOGO = std::string() +
 		" _____ _    _ _____ _          _ _ \n" +
 		"/  __ \\ |  | /  ___| |        | | |\n" +
@@ -799,30 +2803,43 @@ int main() {
 		<< "Github: " << GITHUB << std::endl
 		<< "Welcome to star!" << std::endl << std::endl;
 
-	LinuxShell linux_shell;
+	// 设置了 CHUANWISE_SHELL_TRACE 时从启动开始追踪，退出时导出到它指定的文件
+	char* trace_path = getenv("CHUANWISE_SHELL_TRACE");
+	if (trace_path && *trace_path) {
+		Tracer::get_instance().set_export_path(trace_path);
+		Tracer::get_instance().set_enabled(true);
+		atexit([]() {
+			auto& tracer = Tracer::get_instance();
+			tracer.export_chrome_trace(tracer.get_export_path());
+		});
+	}
 
-	linux_shell.register_command("printerr", [](Command command) {
-		std::cout << "cout" << std::endl;
-		std::cerr << "cerr" << std::endl;
-	});
+	LinuxShell linux_shell;
+	register_test_commands(linux_shell);
 
-	linux_shell.register_command("repeat", [](Command command) {
-		auto arguments = command.get_remain_arguments();
-		if (!arguments.empty()) {
-			std::cout << "arguments: \"" << arguments << "\"" << std::endl;
-		}
-		std::string input;
-		std::getline(std::cin, input);
-		std::cout << "your input is: \"" << input << "\"" << std::endl;
-	});
+	SessionRecorder recorder(linux_shell);
+	if (!record_path.empty() && !recorder.open(record_path)) {
+		std::cerr << "Can not open the session file: " << record_path << std::endl;
+	}
 
+	std::vector<std::string> tokens;
 	std::string input;
 	while (!feof(stdin)) {
-		std::cout << get_user_name() << "@" << get_host_name() << ":" << get_working_path() << "$ ";
-		std::getline(std::cin, input);
+		std::cout << linux_shell.get_prompt();
+
+		// 只有录制会话时才需要保留原始输入
+		try {
+			if (!linux_shell.read_tokens(std::cin, tokens, recorder.is_open() ? &input : nullptr)) {
+				break;
+			}
+		} catch (ShellException& exception) {
+			std::cerr << "ERROR: " << exception.what() << std::endl;
+			continue;
+		}
 
+		recorder.before_command(input);
 		try {
-			linux_shell.on_command(input);
+			linux_shell.on_tokens(tokens);
 		} catch (ShellException& exception) {
 			std::cerr << "ERROR: " << exception.what() << std::endl;
 		}